@@ -30,12 +30,19 @@ pub fn build(b: *std.Build) void {
 
     lib.linkLibC();
     lib.linkLibrary(zlib.artifact("z"));
+    // main.c writes pngs itself on top of zlib, libpng is only here for freetype's png glyphs
     lib.linkLibrary(libpng.artifact("png"));
     lib.linkLibrary(freetype.artifact("freetype"));
 
+    if (target.result.os.tag == .linux) {
+        // shm_open is in librt before glibc 2.34
+        lib.linkSystemLibrary("rt");
+    }
+
     lib.addIncludePath(b.path("src"));
     lib.addCSourceFile(.{ .file = b.path("src/main.c") });
     lib.addCSourceFile(.{ .file = b.path("src/utf8.c") });
+    lib.addCSourceFile(.{ .file = b.path("src/thread.c") });
 
     b.installArtifact(lib);
 
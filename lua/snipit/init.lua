@@ -1,6 +1,7 @@
 local ffi = require("ffi")
 local bit = require("bit")
 local path = require("snipit.path")
+local kitty = require("snipit.kitty")
 
 local M = {}
 
@@ -10,7 +11,19 @@ M.has_setup = false
 
 M.options = {
   save_file = nil,
+  -- "png" or "svg", svg scales with text length instead of pixels and stays sharp when zoomed
+  format = "png",
   -- font_size = 32,
+  -- lines rasterized at once per thread, 0 renders the whole canvas in one go
+  tile_rows = 64,
+  -- images taller than this (in pixels) are saved as several files, 0 disables
+  max_height = 0,
+  -- rasterizer threads, 0 uses every cpu
+  threads = 0,
+  -- space in pixels around the text, the image is cropped to the text itself
+  padding = 16,
+  -- show the snip in a float before copying, needs a terminal with the kitty graphics protocol
+  preview = false,
   fonts = {
     regular = M.root .. "/fonts/UbuntuMono-Regular.ttf",
     bold = M.root .. "/fonts/UbuntuMono-Bold.ttf",
@@ -89,16 +102,15 @@ local function resolve_group(groups, group, hl_group)
   return groups
 end
 
-local function inner_get_ts_syntax(out, line1, line2)
-  local buf = vim.api.nvim_get_current_buf()
-  local highlighter = vim.treesitter.highlighter
-  local buf_highlighter = highlighter.active[buf]
-
-  if not buf_highlighter then
-    return
+local function get_query(buf_highlighter, lang)
+  if buf_highlighter then
+    return buf_highlighter:get_query(lang):query()
   end
+  return vim.treesitter.query.get(lang, "highlights")
+end
 
-  buf_highlighter.tree:for_each_tree(function (tstree, tree)
+local function inner_get_ts_syntax(out, buf, parser, buf_highlighter, line1, line2)
+  parser:for_each_tree(function (tstree, tree)
     if not tstree then
       return
     end
@@ -106,26 +118,22 @@ local function inner_get_ts_syntax(out, line1, line2)
     local root = tstree:root()
     local root_start_row, _, root_end_row, _ = root:range()
 
-    if root_start_row > line2 or root_end_row < line1 then
+    if root_start_row >= line2 or root_end_row < line1 then
       return
     end
 
-    local query = buf_highlighter:get_query(tree:lang())
+    local query = get_query(buf_highlighter, tree:lang())
 
-    if not query:query() then
+    if not query then
       return
     end
 
-    local iter = query:query():iter_captures(root, buf_highlighter.bufnr, line1, line2)
+    local iter = query:iter_captures(root, buf, line1, line2)
 
     for capture, node, metadata in iter do
-      local hl = query.hl_cache[capture]
-      if not hl then
-        goto continue
-      end
-
-      local hl_group = query._query.captures[capture]
-      if not hl_group then
+      local hl_group = query.captures[capture]
+      -- captures starting with _ are only used by predicates
+      if not hl_group or hl_group:sub(1, 1) == "_" then
         goto continue
       end
 
@@ -155,7 +163,7 @@ local function inner_get_ts_syntax(out, line1, line2)
         if row_end + 2 > line2 then
           return
         end
-        inner_get_ts_syntax(out, row_end + 1, line2)
+        inner_get_ts_syntax(out, buf, parser, buf_highlighter, row_end + 1, line2)
         return
       end
 
@@ -181,7 +189,24 @@ local function get_ts_syntax(line1, line2)
     rows = 0,
     cols = 0,
   }
-  inner_get_ts_syntax(out, line1 - 1, line2)
+
+  local buf = vim.api.nvim_get_current_buf()
+  local buf_highlighter = vim.treesitter.highlighter.active[buf]
+
+  local parser = buf_highlighter and buf_highlighter.tree
+  if not parser then
+    local ok
+    ok, parser = pcall(vim.treesitter.get_parser, buf)
+    if not ok or not parser then
+      return out.syntax, out.rows, out.cols
+    end
+  end
+
+  -- the highlighter only parses what was on screen, so parse the selection (and the
+  -- languages injected into it) ourselves instead of the whole buffer
+  parser:parse({ line1 - 1, line2 })
+
+  inner_get_ts_syntax(out, buf, parser, buf_highlighter, line1 - 1, line2)
   return out.syntax, out.rows, out.cols
 end
 
@@ -217,6 +242,12 @@ local function get_foreground(groups)
   return nil
 end
 
+-- number of utf-8 characters, continuation bytes look like 10xxxxxx
+local function utf8_len(str)
+  local _, count = str:gsub("[^\128-\191]", "")
+  return count
+end
+
 local libsn = nil
 local sn_ctx = nil
 
@@ -240,6 +271,213 @@ local function resolve_clipboard()
   end
 end
 
+local function output()
+  local err
+
+  local output_timer = vim.loop.hrtime()
+
+  local out = ffi.new("uint8_t*[1]")
+  local out_len = ffi.new("size_t[1]")
+
+  local save_path = M.options.save_file
+  if save_path then
+    if not path.is_absolute(save_path) then
+      save_path = vim.fn.getcwd() .. "/" .. save_path
+    end
+
+    local parts = M.options.format == "svg" and 1 or libsn.sn_output_count(sn_ctx)
+    local saved = {}
+
+    for part = 0, parts - 1 do
+      if M.options.format == "svg" then
+        err = libsn.sn_output_svg(sn_ctx, out, out_len)
+      else
+        err = libsn.sn_output_part(sn_ctx, part, out, out_len)
+      end
+
+      if err ~= 0 then
+        libsn.sn_done(sn_ctx)
+        error("sn_output: " .. ffi.string(libsn.sn_error_name(err)))
+      end
+
+      local part_path = save_path
+      if parts > 1 then
+        local stem, extension = save_path:match("^(.*)(%.[^%./\\]*)$")
+        part_path = string.format("%s-%d%s", stem or save_path, part + 1, extension or "")
+      end
+
+      local file = io.open(part_path, "wb")
+      assert(file ~= nil)
+
+      file:write(ffi.string(out[0], out_len[0]))
+      file:close()
+
+      libsn.sn_free_output(out)
+      table.insert(saved, part_path)
+    end
+
+    libsn.sn_clear(sn_ctx)
+
+    print("Saved at " .. table.concat(saved, ", "))
+  else
+    if M.options.format == "svg" then
+      err = libsn.sn_output_svg(sn_ctx, out, out_len)
+    else
+      err = libsn.sn_output(sn_ctx, out, out_len)
+    end
+
+    if err ~= 0 then
+      libsn.sn_done(sn_ctx)
+      error("sn_output: " .. ffi.string(libsn.sn_error_name(err)))
+    end
+
+    local image = ffi.string(out[0], out_len[0])
+    libsn.sn_free_output(out)
+
+    local _, cmd = resolve_clipboard()
+    if cmd == nil then
+      error("resolve_clipboard: unknown or unsupported session")
+    end
+
+    if not vim.fn.executable(cmd) then
+      error("resolve_clipboard: '" .. cmd .. "' not found")
+    end
+
+    local pipe
+    if cmd == "xclip" then
+      local mime = M.options.format == "svg" and "image/svg+xml" or "image/png"
+      pipe, err = io.popen("xclip -selection clipboard -t " .. mime .. " -i", "w")
+    elseif cmd == "wl-copy" then
+      assert(false, "not implemented")
+      -- pipe, err = io.popen("wl-copy --type image/png", "w")
+    elseif cmd == "pbcopy" then
+      pipe, err = io.popen("pbcopy", "w")
+    elseif cmd == "powershell" then
+      -- some chatgpt code no idea if its correct
+      -- local ps_cmd = [[
+        -- Add-Type -AssemblyName System.Windows.Forms;
+        -- Add-Type -AssemblyName System.Drawing;
+        -- $bytes = [Console]::OpenStandardInput().ReadToEnd();
+        -- $stream = New-Object System.IO.MemoryStream(, $bytes);
+        -- $image = [System.Drawing.Image]::FromStream($stream);
+        -- [System.Windows.Forms.Clipboard]::SetImage($image);
+      -- ]]
+      assert(false, "not implemented")
+    else
+      assert(false)
+    end
+
+    if pipe == nil then
+      error("open: " .. tostring(err))
+    end
+
+    pipe:write(image)
+    pipe:close()
+
+    print("Copied to clipboard")
+  end
+
+  local output_time = vim.loop.hrtime()
+  -- print("output:", (output_time - output_timer) / 1e6 .. "ms")
+end
+
+local preview_count = 0
+
+-- shows the rasterized canvas in a float through kitty's shared memory transfer,
+-- on_confirm does the actual encoding so cancelled snips never pay for it
+local function preview(on_confirm)
+  preview_count = preview_count + 1
+
+  local name = string.format("/snipit-%d-%d", vim.fn.getpid(), preview_count)
+  local width = ffi.new("uint32_t[1]")
+  local height = ffi.new("uint32_t[1]")
+
+  local err = libsn.sn_preview(sn_ctx, name, width, height)
+  if err ~= 0 then
+    libsn.sn_done(sn_ctx)
+    error("sn_preview: " .. ffi.string(libsn.sn_error_name(err)))
+  end
+
+  -- the image is shown at its own size and only scaled down when it doesn't fit, without a
+  -- reported cell size it is always scaled into cells assumed twice as tall as they are wide
+  local cell_width, cell_height = kitty.cell_size()
+  local scaled = cell_width == nil
+  cell_width, cell_height = cell_width or 8, cell_height or 16
+
+  local max_cols = vim.o.columns - 4
+  local max_rows = vim.o.lines - 4
+
+  local cols = math.ceil(width[0] / cell_width)
+  local rows = math.ceil(height[0] / cell_height)
+
+  if cols > max_cols then
+    scaled = true
+    cols = max_cols
+    rows = math.ceil(cols * cell_width * height[0] / width[0] / cell_height)
+  end
+  if rows > max_rows then
+    scaled = true
+    rows = max_rows
+    cols = math.max(1, math.ceil(rows * cell_height * width[0] / height[0] / cell_width))
+  end
+
+  local row = math.floor((vim.o.lines - rows) / 2) - 1
+  local col = math.floor((vim.o.columns - cols) / 2) - 1
+
+  local buf = vim.api.nvim_create_buf(false, true)
+  local win = vim.api.nvim_open_win(buf, true, {
+    relative = "editor",
+    row = row,
+    col = col,
+    width = cols,
+    height = rows,
+    style = "minimal",
+    border = "single",
+    title = " <CR> snip, q cancel ",
+  })
+
+  -- the float has to be on screen before the image is put over it
+  vim.cmd.redraw()
+
+  -- +1 for the border and +1 as terminal positions start at 1
+  kitty.write(kitty.at(row + 2, col + 2, kitty.show_shm(name, width[0], height[0], preview_count, scaled and cols or nil, scaled and rows or nil)))
+
+  local closed = false
+  local function close(confirm)
+    if closed then
+      return
+    end
+    closed = true
+
+    kitty.write(kitty.delete(preview_count))
+    vim.api.nvim_win_close(win, true)
+
+    -- the terminal unlinks it after reading, unless it never did (not kitty, tmux, ...)
+    libsn.sn_preview_release(name)
+
+    if confirm then
+      on_confirm()
+    else
+      libsn.sn_clear(sn_ctx)
+    end
+  end
+
+  for _, key in ipairs({ "<CR>", "y" }) do
+    vim.keymap.set("n", key, function () close(true) end, { buffer = buf, nowait = true })
+  end
+
+  for _, key in ipairs({ "q", "<Esc>" }) do
+    vim.keymap.set("n", key, function () close(false) end, { buffer = buf, nowait = true })
+  end
+
+  vim.api.nvim_create_autocmd("WinLeave", {
+    buffer = buf,
+    once = true,
+    -- windows can't be closed from inside WinLeave
+    callback = function () vim.schedule(function () close(false) end) end,
+  })
+end
+
 -- this is just ship f ts
 M.snip = function (opts)
   assert(libsn ~= nil and sn_ctx ~= nil)
@@ -274,10 +512,28 @@ M.snip = function (opts)
     error("sn_set_size: " .. ffi.string(libsn.sn_error_name(err)))
   end
 
+  libsn.sn_set_tiling(sn_ctx, M.options.tile_rows, M.options.max_height)
+  libsn.sn_set_threads(sn_ctx, M.options.threads)
+
+  local lines = vim.api.nvim_buf_get_lines(0, opts.line1 - 1, rows, false)
+
   local draw_timer = vim.loop.hrtime()
   for row, line in pairs(syntax) do
+    local text = lines[row - opts.line1 + 1]
+    -- groups are sorted by col, so characters are counted from the previous group on
+    local byte, char = 0, 0
     for i = 1, #line do
       local val = line[i]
+      -- cols are bytes, the canvas wants characters
+      local col = val.col
+      if text then
+        if val.col < byte then
+          byte, char = 0, 0
+        end
+        char = char + utf8_len(text:sub(byte + 1, val.col))
+        byte = val.col
+        col = char
+      end
       local foreground = get_foreground(val.hl_groups) or normal.foreground
 
       local r = bit.band(bit.rshift(foreground, 16), 0xFF)
@@ -287,7 +543,7 @@ M.snip = function (opts)
       libsn.sn_set_font(sn_ctx, combine_fonts(val.hl_groups))
       libsn.sn_set_color(sn_ctx, r, g, b)
 
-      err = libsn.sn_draw_text(sn_ctx, row - opts.line1, val.col, val.token)
+      err = libsn.sn_draw_text(sn_ctx, row - opts.line1, col, val.token)
 
       if err ~= 0 then
         libsn.sn_done(sn_ctx)
@@ -296,81 +552,19 @@ M.snip = function (opts)
     end
   end
 
-  local draw_time = vim.loop.hrtime()
-  -- print("draw:", (draw_time - draw_timer) / 1e6 .. "ms")
-
-  local output_timer = vim.loop.hrtime()
-
-  local out = ffi.new("uint8_t*[1]")
-  local out_len = ffi.new("size_t[1]")
-
-  err = libsn.sn_output(sn_ctx, out, out_len)
+  err = libsn.sn_layout(sn_ctx, M.options.padding)
   if err ~= 0 then
     libsn.sn_done(sn_ctx)
-    error("sn_output: " .. ffi.string(sn_ctx.sn_error_name(err)))
+    error("sn_layout: " .. ffi.string(libsn.sn_error_name(err)))
   end
 
-  local image = ffi.string(out[0], out_len[0])
-
-  local output_time = vim.loop.hrtime()
-  -- print("output:", (output_time - output_timer) / 1e6 .. "ms")
-
-  local save_path = M.options.save_file
-  if save_path then
-    if not path.is_absolute(save_path) then
-      save_path = vim.fn.getcwd() .. "/" .. save_path
-    end
-
-    local file = io.open(save_path, "wb")
-    assert(file ~= nil)
-
-    file:write(image)
-    file:close()
-
-    print("Saved at " .. save_path)
+  local draw_time = vim.loop.hrtime()
+  -- print("draw:", (draw_time - draw_timer) / 1e6 .. "ms")
 
-    libsn.sn_free_output(out)
+  if M.options.preview then
+    preview(output)
   else
-    local _, cmd = resolve_clipboard()
-    if cmd == nil then
-      error("resolve_clipboard: unknown or unsupported session")
-    end
-
-    if not vim.fn.executable(cmd) then
-      error("resolve_clipboard: '" .. cmd .. "' not found")
-    end
-
-    local pipe
-    if cmd == "xclip" then
-      pipe, err = io.popen("xclip -selection clipboard -t image/png -i", "w")
-    elseif cmd == "wl-copy" then
-      assert(false, "not implemented")
-      -- pipe, err = io.popen("wl-copy --type image/png", "w")
-    elseif cmd == "pbcopy" then
-      pipe, err = io.popen("pbcopy", "w")
-    elseif cmd == "powershell" then
-      -- some chatgpt code no idea if its correct
-      -- local ps_cmd = [[
-        -- Add-Type -AssemblyName System.Windows.Forms;
-        -- Add-Type -AssemblyName System.Drawing;
-        -- $bytes = [Console]::OpenStandardInput().ReadToEnd();
-        -- $stream = New-Object System.IO.MemoryStream(, $bytes);
-        -- $image = [System.Drawing.Image]::FromStream($stream);
-        -- [System.Windows.Forms.Clipboard]::SetImage($image);
-      -- ]]
-      assert(false, "not implemented")
-    else
-      assert(false)
-    end
-
-    if pipe == nil then
-      error("open: " .. tostring(err))
-    end
-
-    pipe:write(image)
-    pipe:close()
-
-    print("Copied to clipboard")
+    output()
   end
 
   -- print("took:", (vim.loop.hrtime() - elapsed) / 1e6 .. "ms")
@@ -400,7 +594,12 @@ local function resolve_lib_path(root)
 end
 
 M.setup = function ()
-  libsn = ffi.load(resolve_lib_path(M.root)) -- todo: print that this platform is not supported by default, but they can compile it
+  local lib_path = resolve_lib_path(M.root)
+  if vim.loop.fs_stat(lib_path) == nil then
+    error("setup: '" .. lib_path .. "' not found, build it with `make` (zig 0.14) in " .. M.root)
+  end
+
+  libsn = ffi.load(lib_path)
   assert(libsn ~= nil)
 
   -- :// we need to fix multi line strings
@@ -412,12 +611,20 @@ M.setup = function ()
 
     void sn_done(sn_ctx ctx);
 
-    int sn_set_size(sn_ctx ctx, uint16_t rows, uint16_t cols);
+    int sn_set_size(sn_ctx ctx, uint32_t rows, uint32_t cols);
+
+    void sn_set_tiling(sn_ctx ctx, uint32_t tile_rows, uint32_t max_height);
+
+    void sn_set_threads(sn_ctx ctx, uint32_t threads);
+
+    void sn_clear(sn_ctx ctx);
 
     int sn_add_font(sn_ctx ctx, const char* sub_path, uint8_t font_type);
 
     int sn_draw_text(sn_ctx ctx, uint32_t row, uint32_t col, const char* text);
 
+    int sn_layout(sn_ctx ctx, uint32_t padding);
+
     void sn_set_font(sn_ctx ctx, uint8_t font_type);
 
     void sn_set_fill(sn_ctx ctx, uint8_t r, uint8_t g, uint8_t b);
@@ -426,6 +633,16 @@ M.setup = function ()
 
     int sn_output(sn_ctx ctx, uint8_t** dist, size_t* dist_len);
 
+    int sn_output_svg(sn_ctx ctx, uint8_t** dist, size_t* dist_len);
+
+    int sn_preview(sn_ctx ctx, const char* name, uint32_t* width, uint32_t* height);
+
+    int sn_preview_release(const char* name);
+
+    uint32_t sn_output_count(sn_ctx ctx);
+
+    int sn_output_part(sn_ctx ctx, uint32_t part, uint8_t** dist, size_t* dist_len);
+
     void sn_free_output(uint8_t** src);
 
     const char* sn_error_name(int err);
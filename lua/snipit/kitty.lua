@@ -0,0 +1,84 @@
+local ffi = require("ffi")
+
+local Kitty = {}
+
+ffi.cdef[[
+  struct snipit_winsize {
+    unsigned short ws_row;
+    unsigned short ws_col;
+    unsigned short ws_xpixel;
+    unsigned short ws_ypixel;
+  };
+
+  int ioctl(int fd, unsigned long request, ...);
+]]
+
+---@param control string
+---@param payload string|nil
+---@return string
+local function command(control, payload)
+  if payload then
+    return "\27_G" .. control .. ";" .. payload .. "\27\\"
+  end
+  return "\27_G" .. control .. "\27\\"
+end
+
+-- size of a terminal cell in pixels, nil when the terminal doesn't report it
+---@return number|nil, number|nil
+Kitty.cell_size = function()
+  if jit.os == "Windows" then
+    return nil
+  end
+
+  local TIOCGWINSZ = jit.os == "OSX" and 0x40087468 or 0x5413
+  local out = ffi.new("struct snipit_winsize[1]")
+  if ffi.C.ioctl(2, TIOCGWINSZ, out) ~= 0 then
+    return nil
+  end
+
+  local ws = out[0]
+  if ws.ws_col == 0 or ws.ws_row == 0 or ws.ws_xpixel == 0 or ws.ws_ypixel == 0 then
+    return nil
+  end
+
+  return ws.ws_xpixel / ws.ws_col, ws.ws_ypixel / ws.ws_row
+end
+
+-- displays raw rgb pixels from a posix shared memory object, kitty unlinks it after reading
+-- but other terminals may not, so the object still has to be released by the caller
+---@param name string
+---@param width integer pixels
+---@param height integer pixels
+---@param id integer
+---@param cols integer|nil cells the image is scaled into, nil shows it at its own size
+---@param rows integer|nil
+---@return string
+Kitty.show_shm = function(name, width, height, id, cols, rows)
+  local control = string.format("a=T,f=24,t=s,s=%d,v=%d,i=%d,C=1,q=2", width, height, id)
+  if cols and rows then
+    control = control .. string.format(",c=%d,r=%d", cols, rows)
+  end
+  return command(control, vim.base64.encode(name))
+end
+
+---@param id integer
+---@return string
+Kitty.delete = function(id)
+  return command(string.format("a=d,d=I,i=%d,q=2", id))
+end
+
+-- runs seq with the cursor at row, col (starting at 1) and puts the cursor back
+---@param row integer
+---@param col integer
+---@param seq string
+---@return string
+Kitty.at = function(row, col, seq)
+  return string.format("\27[s\27[%d;%dH%s\27[u", row, col, seq)
+end
+
+---@param seq string
+Kitty.write = function(seq)
+  vim.api.nvim_chan_send(vim.v.stderr, seq)
+end
+
+return Kitty
@@ -1,12 +1,24 @@
 #include <assert.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
-#include <png.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <zlib.h>
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include FT_TRUETYPE_TABLES_H
+#include FT_OUTLINE_H
 
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "thread.h"
 #include "utf8.h"
 
 #define SN_API extern
@@ -41,8 +53,100 @@ struct sn_bitmap_s {
   uint32_t height;
 } typedef sn_bitmap_t;
 
-struct sn_ctx_s {
+// rendered glyphs are kept for the whole ctx lifetime, so rasterizing is
+// only blending already rendered coverage and that can be done from any thread
+struct sn_glyph_s {
+  uint8_t* buffer; // 8-bit coverage, width * rows
+  uint32_t width;
+  uint32_t rows;
+
+  int32_t bearing_x;
+  int32_t bearing_y;
+  int32_t advance;
+
+  uint32_t codepoint;
+  uint32_t index; // in the face, for reloading the outline
+  int8_t font_type;
+} typedef sn_glyph_t;
+
+struct sn_glyph_cache_s {
+  sn_glyph_t* glyphs;
+  size_t len;
+  size_t cap;
+
+  uint32_t* slots; // open addressing, indices into glyphs or SN_GLYPH_NONE
+  size_t slots_cap;
+} typedef sn_glyph_cache_t;
+
+#define SN_GLYPH_NONE UINT32_MAX
+
+struct sn_placement_s {
+  uint32_t glyph;
+  int32_t x;
+} typedef sn_placement_t;
+
+struct sn_run_s {
+  uint32_t row;
+  sn_color_t color;
+
+  size_t first; // into placements
+  uint32_t count;
+} typedef sn_run_t;
+
+// pixels of a scanline that glyphs can touch, the rest is fill_color and never written
+struct sn_span_s {
+  uint32_t x0;
+  uint32_t x1;
+} typedef sn_span_t;
+
+// ink box of a whole line relative to its pen origin, x0 > x1 when nothing is drawn
+struct sn_ink_s {
+  int32_t x0;
+  int32_t x1;
+  int32_t y0;
+  int32_t y1;
+} typedef sn_ink_t;
+
+struct sn_tile_s {
   sn_bitmap_t bitmap;
+  uint32_t y; // canvas row of the first scanline
+
+  // one per scanline, NULL means the whole tile gets filled
+  sn_span_t* spans;
+} typedef sn_tile_t;
+
+struct sn_ctx_s {
+  // nothing is allocated for the canvas until output, draws are only recorded
+  uint32_t rows;
+  uint32_t width;
+  uint32_t height;
+
+  // canvas position of the first line's top left corner, moved by sn_layout
+  int32_t origin_x;
+  int32_t origin_y;
+
+  sn_run_t* runs;
+  size_t runs_len;
+  size_t runs_cap;
+
+  sn_placement_t* placements;
+  size_t placements_len;
+  size_t placements_cap;
+
+  // runs ordered by row (stable), row_start and row_ink have rows + 1 and rows entries
+  uint32_t* row_index;
+  uint32_t* row_start;
+  sn_ink_t* row_ink;
+
+  sn_glyph_cache_t glyphs;
+
+  // ink extent of every cached glyph relative to the top of its line
+  int32_t ink_top;
+  int32_t ink_bottom;
+
+  uint32_t tile_rows; // 0 means the whole canvas is one tile
+  uint32_t max_height; // 0 means one image
+  uint32_t threads;
 
   FT_Library library;
 
@@ -55,7 +159,6 @@ struct sn_ctx_s {
 
 typedef sn_ctx_t* sn_ctx;
 
-// todo: enable dymanic size after we implement own arr_list thingy
 SN_API sn_ctx sn_init() {
   FT_Error err;
   sn_ctx out = malloc(sizeof(sn_ctx_t));
@@ -70,9 +173,33 @@ SN_API sn_ctx sn_init() {
     goto err;
   }
 
-  out->bitmap.width = 0; // tst
-  out->bitmap.height = 0;
-  out->bitmap.buffer = NULL;
+  out->rows = 0;
+  out->width = 0;
+  out->height = 0;
+
+  out->origin_x = 0;
+  out->origin_y = 0;
+
+  out->runs = NULL;
+  out->runs_len = 0;
+  out->runs_cap = 0;
+
+  out->placements = NULL;
+  out->placements_len = 0;
+  out->placements_cap = 0;
+
+  out->row_index = NULL;
+  out->row_start = NULL;
+  out->row_ink = NULL;
+
+  out->glyphs = (sn_glyph_cache_t){ NULL, 0, 0, NULL, 0 };
+
+  out->ink_top = 0;
+  out->ink_bottom = SN_LINE_HEIGHT;
+
+  out->tile_rows = 0;
+  out->max_height = 0;
+  out->threads = sn_cpu_count();
 
   for (int i = 0; i < SN_FONT_TYPES; i++) {
     out->fonts[i] = NULL;
@@ -86,21 +213,50 @@ SN_API sn_ctx sn_init() {
 
 err:
   if (out == NULL) return NULL;
-
-  if (out->bitmap.buffer != NULL) {
-    free(out->bitmap.buffer);
-  }
    
   free(out);
   return NULL;
 }
 
+void sn_drop_index(sn_ctx ctx) {
+  free(ctx->row_index);
+  free(ctx->row_start);
+  free(ctx->row_ink);
+  ctx->row_index = NULL;
+  ctx->row_start = NULL;
+  ctx->row_ink = NULL;
+}
+
+// forgets the canvas and everything drawn on it, glyph cache is kept
+SN_API void sn_clear(sn_ctx ctx) {
+  assert(ctx != NULL);
+
+  sn_drop_index(ctx);
+
+  ctx->runs_len = 0;
+  ctx->placements_len = 0;
+
+  ctx->rows = 0;
+  ctx->width = 0;
+  ctx->height = 0;
+
+  ctx->origin_x = 0;
+  ctx->origin_y = 0;
+}
+
 SN_API void sn_done(sn_ctx ctx) {
   assert(ctx != NULL);
 
-  if (ctx->bitmap.buffer != NULL) {
-    free(ctx->bitmap.buffer);
+  sn_clear(ctx);
+
+  free(ctx->runs);
+  free(ctx->placements);
+
+  for (size_t i = 0; i < ctx->glyphs.len; i++) {
+    free(ctx->glyphs.glyphs[i].buffer);
   }
+  free(ctx->glyphs.glyphs);
+  free(ctx->glyphs.slots);
 
   for (uint8_t i = 0; i < SN_FONT_TYPES; i++) {
     if (ctx->fonts[i] == NULL) continue;
@@ -112,30 +268,48 @@ SN_API void sn_done(sn_ctx ctx) {
   free(ctx);
 }
 
-SN_API sn_error sn_set_size(sn_ctx ctx, uint16_t rows, uint16_t cols) {
-  assert(ctx->bitmap.buffer == NULL);
+// the largest dimension a png can have
+#define SN_MAX_DIMENSION 0x7FFFFFFF
 
-  uint32_t width = cols * (SN_FONT_SIZE >> 1);
-  uint32_t height = rows * SN_LINE_HEIGHT;
+SN_API sn_error sn_set_size(sn_ctx ctx, uint32_t rows, uint32_t cols) {
+  assert(ctx != NULL);
 
-  ctx->bitmap.buffer = malloc(width * height * 3);
-  if (ctx->bitmap.buffer == NULL) {
-    return FT_Err_Out_Of_Memory;
-  }
+  sn_clear(ctx);
+
+  uint64_t width = (uint64_t)cols * (SN_FONT_SIZE >> 1);
+  uint64_t height = (uint64_t)rows * SN_LINE_HEIGHT;
 
-  ctx->bitmap.width = width;
-  ctx->bitmap.height = height;
+  if (width > SN_MAX_DIMENSION || height > SN_MAX_DIMENSION) {
+    return FT_Err_Array_Too_Large;
+  }
 
-  uint8_t* src = ctx->bitmap.buffer;
-  for (uint32_t i = 0; i <  ctx->bitmap.width * ctx->bitmap.height; i++) {
-    *src++ = ctx->fill_color.r;
-    *src++ = ctx->fill_color.g;
-    *src++ = ctx->fill_color.b;
+  // a single scanline still has to fit in memory
+  if (width * 3 > SIZE_MAX) {
+    return FT_Err_Array_Too_Large;
   }
 
+  ctx->rows = rows;
+  ctx->width = width;
+  ctx->height = height;
+
   return 0;
 }
 
+// splits the canvas into bands of tile_rows lines which are rasterized in parallel and
+// streamed into the encoder, so only a few bands are in memory at once
+// max_height above 0 splits the output into several images, see sn_output_count
+SN_API void sn_set_tiling(sn_ctx ctx, uint32_t tile_rows, uint32_t max_height) {
+  assert(ctx != NULL);
+  ctx->tile_rows = tile_rows;
+  ctx->max_height = max_height;
+}
+
+// 0 uses every cpu, 1 rasterizes on the calling thread only
+SN_API void sn_set_threads(sn_ctx ctx, uint32_t threads) {
+  assert(ctx != NULL);
+  ctx->threads = threads > 0 ? threads : sn_cpu_count();
+}
+
 SN_API const char* sn_error_name(sn_error err) {
   return FT_Error_String(err);
 }
@@ -191,16 +365,101 @@ err:
   return err;
 }
 
-sn_error sn_render_codepoint(sn_ctx ctx, int32_t off_x, int32_t off_y, uint32_t codepoint, uint32_t* advance) {
-  assert(ctx->bitmap.width > off_x);
-  assert(ctx->bitmap.height > off_y);
+size_t grow_capacity(size_t curr, size_t minimum) {
+  size_t new_cap = curr;
+  static const size_t init_capacity = 64; // todd: get progromaticly we can use zig for that
+
+  while (1) {
+    new_cap += new_cap / 2 + init_capacity;
+    if (new_cap >= minimum)
+      return new_cap;
+  }
+}
+
+// makes sure that *items can hold minimum elements of size bytes
+sn_error sn_reserve(void** items, size_t* cap, size_t minimum, size_t size) {
+  if (minimum <= *cap) {
+    return 0;
+  }
+
+  size_t new_cap = grow_capacity(*cap, minimum);
+  if (new_cap > SIZE_MAX / size) {
+    return FT_Err_Out_Of_Memory;
+  }
+
+  void* new = realloc(*items, new_cap * size);
+  if (new == NULL) {
+    return FT_Err_Out_Of_Memory;
+  }
+
+  *items = new;
+  *cap = new_cap;
+
+  return 0;
+}
+
+uint32_t sn_glyph_hash(int8_t font_type, uint32_t codepoint) {
+  return (codepoint * 2654435761u) ^ ((uint32_t)font_type << 29);
+}
+
+sn_error sn_glyph_cache_rehash(sn_glyph_cache_t* cache, size_t slots_cap) {
+  uint32_t* slots = malloc(slots_cap * sizeof(uint32_t));
+  if (slots == NULL) {
+    return FT_Err_Out_Of_Memory;
+  }
+
+  for (size_t i = 0; i < slots_cap; i++) {
+    slots[i] = SN_GLYPH_NONE;
+  }
+
+  for (size_t i = 0; i < cache->len; i++) {
+    sn_glyph_t* glyph = &cache->glyphs[i];
+    size_t slot = sn_glyph_hash(glyph->font_type, glyph->codepoint) & (slots_cap - 1);
+    while (slots[slot] != SN_GLYPH_NONE) {
+      slot = (slot + 1) & (slots_cap - 1);
+    }
+    slots[slot] = i;
+  }
+
+  free(cache->slots);
+  cache->slots = slots;
+  cache->slots_cap = slots_cap;
+
+  return 0;
+}
 
+// renders codepoint with the current font unless it is already cached
+sn_error sn_render_codepoint(sn_ctx ctx, uint32_t codepoint, uint32_t* out) {
   assert(ctx != NULL);
   assert(ctx->font_type != -1);
   assert(ctx->fonts[ctx->font_type] != NULL);
 
+  sn_glyph_cache_t* cache = &ctx->glyphs;
+  sn_error err;
+
+  if ((cache->len + 1) * 2 > cache->slots_cap) {
+    err = sn_glyph_cache_rehash(cache, cache->slots_cap == 0 ? 256 : cache->slots_cap * 2);
+    if (err != 0) {
+      return err;
+    }
+  }
+
+  size_t slot = sn_glyph_hash(ctx->font_type, codepoint) & (cache->slots_cap - 1);
+  while (cache->slots[slot] != SN_GLYPH_NONE) {
+    sn_glyph_t* glyph = &cache->glyphs[cache->slots[slot]];
+    if (glyph->codepoint == codepoint && glyph->font_type == ctx->font_type) {
+      *out = cache->slots[slot];
+      return 0;
+    }
+    slot = (slot + 1) & (cache->slots_cap - 1);
+  }
+
+  err = sn_reserve((void**)&cache->glyphs, &cache->cap, cache->len + 1, sizeof(sn_glyph_t));
+  if (err != 0) {
+    return err;
+  }
+
   FT_Face* pface = &ctx->fonts[ctx->font_type];
-  FT_Error err; 
 
   uint32_t idx = FT_Get_Char_Index(*pface, codepoint); // fire - 0x1F525
 
@@ -216,79 +475,313 @@ sn_error sn_render_codepoint(sn_ctx ctx, int32_t off_x, int32_t off_y, uint32_t
     return err;
   }
 
-  if (glyph->bitmap.pixel_mode == FT_PIXEL_MODE_BGRA) {
-    // before rendering these colored emojis we will need to scale them down
-    assert(false);
+  // before rendering these colored emojis we will need to scale them down
+  assert(glyph->bitmap.pixel_mode != FT_PIXEL_MODE_BGRA);
 
-    uint8_t* src = glyph->bitmap.buffer;
+  sn_glyph_t* cached = &cache->glyphs[cache->len];
 
-    // we would need to scale this down
-    for (uint32_t y = 0; y < glyph->bitmap.rows; y++) {
-      for (uint32_t x = 0; x < glyph->bitmap.width; x++) {
-        uint8_t b = *src++;
-        uint8_t g = *src++;
-        uint8_t r = *src++;
-        uint8_t a = *src++;
-      }
+  // todo fix that these values can be signed
+  cached->bearing_x = glyph->metrics.horiBearingX >> 6;
+  cached->bearing_y = glyph->metrics.horiBearingY >> 6;
+  cached->advance = glyph->advance.x >> 6; // todo: add kerning if i rly want to
+  cached->width = glyph->bitmap.width;
+  cached->rows = glyph->bitmap.rows;
+  cached->codepoint = codepoint;
+  cached->index = idx;
+  cached->font_type = ctx->font_type;
+  cached->buffer = NULL;
+
+  assert(cached->bearing_y <= SN_FONT_SIZE);
+
+  if (cached->width * cached->rows > 0) {
+    cached->buffer = malloc(cached->width * cached->rows);
+    if (cached->buffer == NULL) {
+      return FT_Err_Out_Of_Memory;
     }
-  } else {
-    // todo fix that these values can be signed
-    int32_t bearing_x = glyph->metrics.horiBearingX >> 6;
-    int32_t bearing_y = glyph->metrics.horiBearingY >> 6;
 
-    assert(bearing_y <= SN_FONT_SIZE);
+    for (uint32_t y = 0; y < cached->rows; y++) {
+      memcpy(cached->buffer + y * cached->width, glyph->bitmap.buffer + y * glyph->bitmap.pitch, cached->width);
+    }
 
-    // we need to fix these negative bearings
+    int32_t top = SN_FONT_SIZE - cached->bearing_y;
+    ctx->ink_top = min(ctx->ink_top, top);
+    ctx->ink_bottom = max(ctx->ink_bottom, top + (int32_t)cached->rows);
+  }
 
-    off_y += SN_FONT_SIZE - bearing_y;
-    off_x += bearing_x;
+  slot = sn_glyph_hash(ctx->font_type, codepoint) & (cache->slots_cap - 1);
+  while (cache->slots[slot] != SN_GLYPH_NONE) {
+    slot = (slot + 1) & (cache->slots_cap - 1);
+  }
+  cache->slots[slot] = cache->len;
 
-    for (uint32_t y = 0; y < min(glyph->bitmap.rows, min(ctx->bitmap.height, ctx->bitmap.height - off_y)); y++) {
-      for (uint32_t x = 0; x < min(glyph->bitmap.width, min(ctx->bitmap.width, ctx->bitmap.width - off_x)); x++) {
-        uint8_t h = glyph->bitmap.buffer[y * glyph->bitmap.width + x];
-        uint8_t inv_h = 255 - h;
+  *out = cache->len++;
 
-        size_t bitmap_len = ctx->bitmap.width * ctx->bitmap.height;
-        size_t bitmap_idx = (y + off_y) * ctx->bitmap.width + x + off_x;
+  return 0;
+}
 
-        assert(bitmap_len > bitmap_idx);
+SN_API sn_error sn_draw_text(sn_ctx ctx, uint32_t row, uint32_t col, const char* text) {
+  assert(ctx != NULL);
+  assert(ctx->rows > row);
 
-        uint8_t* bg_r = &ctx->bitmap.buffer[bitmap_idx * 3 + 0];
-        uint8_t* bg_g = &ctx->bitmap.buffer[bitmap_idx * 3 + 1];
-        uint8_t* bg_b = &ctx->bitmap.buffer[bitmap_idx * 3 + 2];
+  sn_error err;
 
-        *bg_r = (inv_h * (*bg_r) + h * ctx->pencil_color.r) / 255;
-        *bg_g = (inv_h * (*bg_g) + h * ctx->pencil_color.g) / 255;
-        *bg_b = (inv_h * (*bg_b) + h * ctx->pencil_color.b) / 255;
-      }
-    }
-  }
-  // todo: add kerning if i rly want to
-  if (advance != NULL) {
-    *advance = glyph->advance.x >> 6;
+  err = sn_reserve((void**)&ctx->runs, &ctx->runs_cap, ctx->runs_len + 1, sizeof(sn_run_t));
+  if (err != 0) {
+    return err;
   }
 
-  return 0;
-}
+  sn_run_t* run = &ctx->runs[ctx->runs_len];
+  run->row = row;
+  run->color = ctx->pencil_color;
+  run->first = ctx->placements_len;
+  run->count = 0;
 
-SN_API sn_error sn_draw_text(sn_ctx ctx, uint32_t row, uint32_t col, const char* text) {
   utf8_iter iter;
   utf8_init(&iter, text);
 
-  uint32_t x = 0;
-  while (utf8_next(&iter)) {
-    uint32_t advance; 
-    sn_error err = sn_render_codepoint(ctx, col * (SN_FONT_SIZE >> 1) + x, row * SN_LINE_HEIGHT, iter.codepoint, &advance);
+  // glyphs past the canvas are still recorded, sn_layout may grow it to fit them
+  int64_t x = (int64_t)col * (SN_FONT_SIZE >> 1);
+  while (x < SN_MAX_DIMENSION && utf8_next(&iter)) {
+    uint32_t glyph;
+    err = sn_render_codepoint(ctx, iter.codepoint, &glyph);
+    if (err != 0) {
+      return err;
+    }
+
+    err = sn_reserve((void**)&ctx->placements, &ctx->placements_cap, ctx->placements_len + 1, sizeof(sn_placement_t));
     if (err != 0) {
       return err;
     }
-    x += advance;
-    text++;
+
+    ctx->placements[ctx->placements_len++] = (sn_placement_t){ glyph, x };
+    run->count++;
+
+    x += ctx->glyphs.glyphs[glyph].advance;
+  }
+
+  ctx->runs_len++;
+  sn_drop_index(ctx);
+
+  return 0;
+}
+
+// measures the ink of everything drawn so far from the cached glyph metrics and resizes the
+// canvas to exactly fit it plus padding on every side, nothing is rasterized here
+SN_API sn_error sn_layout(sn_ctx ctx, uint32_t padding) {
+  assert(ctx != NULL);
+
+  int64_t min_x = INT64_MAX;
+  int64_t min_y = INT64_MAX;
+  int64_t max_x = INT64_MIN;
+  int64_t max_y = INT64_MIN;
+
+  for (size_t i = 0; i < ctx->runs_len; i++) {
+    const sn_run_t* run = &ctx->runs[i];
+    int64_t line_y = (int64_t)run->row * SN_LINE_HEIGHT + SN_FONT_SIZE;
+
+    for (uint32_t k = 0; k < run->count; k++) {
+      const sn_placement_t* placement = &ctx->placements[run->first + k];
+      const sn_glyph_t* glyph = &ctx->glyphs.glyphs[placement->glyph];
+
+      if (glyph->buffer == NULL) continue;
+
+      int64_t x = (int64_t)placement->x + glyph->bearing_x;
+      int64_t y = line_y - glyph->bearing_y;
+
+      min_x = min(min_x, x);
+      min_y = min(min_y, y);
+      max_x = max(max_x, x + glyph->width);
+      max_y = max(max_y, y + glyph->rows);
+    }
+  }
+
+  // nothing visible, keep the size from sn_set_size
+  if (min_x > max_x) {
+    return 0;
+  }
+
+  uint64_t width = (uint64_t)(max_x - min_x) + 2 * (uint64_t)padding;
+  uint64_t height = (uint64_t)(max_y - min_y) + 2 * (uint64_t)padding;
+
+  if (width > SN_MAX_DIMENSION || height > SN_MAX_DIMENSION) {
+    return FT_Err_Array_Too_Large;
+  }
+
+  ctx->origin_x = padding - min_x;
+  ctx->origin_y = padding - min_y;
+  ctx->width = width;
+  ctx->height = height;
+
+  return 0;
+}
+
+// counting sort of runs by row, keeps the draw order inside a row
+sn_error sn_build_index(sn_ctx ctx) {
+  if (ctx->row_start != NULL) {
+    return 0;
+  }
+
+  ctx->row_start = calloc((size_t)ctx->rows + 1, sizeof(uint32_t));
+  ctx->row_index = malloc(max(ctx->runs_len, 1) * sizeof(uint32_t));
+  ctx->row_ink = malloc(max(ctx->rows, 1) * sizeof(sn_ink_t));
+
+  if (ctx->row_start == NULL || ctx->row_index == NULL || ctx->row_ink == NULL) {
+    sn_drop_index(ctx);
+    return FT_Err_Out_Of_Memory;
+  }
+
+  for (size_t i = 0; i < ctx->runs_len; i++) {
+    ctx->row_start[ctx->runs[i].row + 1]++;
+  }
+
+  for (uint32_t r = 0; r < ctx->rows; r++) {
+    ctx->row_start[r + 1] += ctx->row_start[r];
+  }
+
+  // row_start[r] is used as the insert cursor and shifted back after
+  for (size_t i = 0; i < ctx->runs_len; i++) {
+    ctx->row_index[ctx->row_start[ctx->runs[i].row]++] = i;
+  }
+
+  for (uint32_t r = ctx->rows; r > 0; r--) {
+    ctx->row_start[r] = ctx->row_start[r - 1];
+  }
+  ctx->row_start[0] = 0;
+
+  for (uint32_t r = 0; r < ctx->rows; r++) {
+    ctx->row_ink[r] = (sn_ink_t){ INT32_MAX, INT32_MIN, INT32_MAX, INT32_MIN };
+  }
+
+  for (size_t i = 0; i < ctx->runs_len; i++) {
+    const sn_run_t* run = &ctx->runs[i];
+    sn_ink_t* ink = &ctx->row_ink[run->row];
+
+    for (uint32_t k = 0; k < run->count; k++) {
+      const sn_placement_t* placement = &ctx->placements[run->first + k];
+      const sn_glyph_t* glyph = &ctx->glyphs.glyphs[placement->glyph];
+
+      if (glyph->buffer == NULL) continue;
+
+      int32_t x = placement->x + glyph->bearing_x;
+      int32_t y = SN_FONT_SIZE - glyph->bearing_y;
+
+      ink->x0 = min(ink->x0, x);
+      ink->x1 = max(ink->x1, x + (int32_t)glyph->width);
+      ink->y0 = min(ink->y0, y);
+      ink->y1 = max(ink->y1, y + (int32_t)glyph->rows);
+    }
   }
 
   return 0;
 }
 
+void sn_fill(sn_bitmap_t* bitmap, sn_color_t color) {
+  uint8_t* src = bitmap->buffer;
+  for (size_t i = 0; i < (size_t)bitmap->width * bitmap->height; i++) {
+    *src++ = color.r;
+    *src++ = color.g;
+    *src++ = color.b;
+  }
+}
+
+// off_x, off_y are the canvas position of the glyph's top left corner
+void sn_blit_glyph(sn_tile_t* tile, const sn_glyph_t* glyph, int64_t off_x, int64_t off_y, sn_color_t color) {
+  int64_t y0 = max(off_y, (int64_t)tile->y);
+  int64_t y1 = min(off_y + glyph->rows, (int64_t)tile->y + tile->bitmap.height);
+  int64_t x0 = max(off_x, 0);
+  int64_t x1 = min(off_x + glyph->width, (int64_t)tile->bitmap.width);
+
+  for (int64_t y = y0; y < y1; y++) {
+    const uint8_t* src = glyph->buffer + (y - off_y) * glyph->width + (x0 - off_x);
+    uint8_t* dst = tile->bitmap.buffer + ((y - tile->y) * tile->bitmap.width + x0) * 3;
+
+    for (int64_t x = x0; x < x1; x++) {
+      uint8_t h = *src++;
+      uint8_t inv_h = 255 - h;
+
+      dst[0] = (inv_h * dst[0] + h * color.r) / 255;
+      dst[1] = (inv_h * dst[1] + h * color.g) / 255;
+      dst[2] = (inv_h * dst[2] + h * color.b) / 255;
+      dst += 3;
+    }
+  }
+}
+
+// marks which pixels of every scanline lines can reach and fills only those
+void sn_span_tile(sn_ctx ctx, sn_tile_t* tile, int64_t row_begin, int64_t row_end) {
+  for (uint32_t y = 0; y < tile->bitmap.height; y++) {
+    tile->spans[y] = (sn_span_t){ tile->bitmap.width, 0 };
+  }
+
+  for (int64_t r = row_begin; r < row_end; r++) {
+    const sn_ink_t* ink = &ctx->row_ink[r];
+    if (ink->x0 >= ink->x1) continue;
+
+    int64_t line_y = r * SN_LINE_HEIGHT + ctx->origin_y - tile->y;
+
+    int64_t y0 = max(line_y + ink->y0, 0);
+    int64_t y1 = min(line_y + ink->y1, (int64_t)tile->bitmap.height);
+    int64_t x0 = max((int64_t)ink->x0 + ctx->origin_x, 0);
+    int64_t x1 = min((int64_t)ink->x1 + ctx->origin_x, (int64_t)tile->bitmap.width);
+
+    if (x0 >= x1) continue;
+
+    for (int64_t y = y0; y < y1; y++) {
+      tile->spans[y].x0 = min(tile->spans[y].x0, (uint32_t)x0);
+      tile->spans[y].x1 = max(tile->spans[y].x1, (uint32_t)x1);
+    }
+  }
+
+  for (uint32_t y = 0; y < tile->bitmap.height; y++) {
+    sn_span_t span = tile->spans[y];
+    if (span.x0 >= span.x1) continue;
+
+    sn_bitmap_t line;
+    line.buffer = tile->bitmap.buffer + ((size_t)y * tile->bitmap.width + span.x0) * 3;
+    line.width = span.x1 - span.x0;
+    line.height = 1;
+
+    sn_fill(&line, ctx->fill_color);
+  }
+}
+
+// draws every run whose ink reaches into the tile, clipped to it, so tiles never touch each other
+void sn_rasterize_tile(sn_ctx ctx, sn_tile_t* tile) {
+  assert(ctx->row_start != NULL);
+
+  // relative to the first line
+  int64_t top = (int64_t)tile->y - ctx->origin_y;
+  int64_t bottom = top + tile->bitmap.height;
+
+  // lines which can overhang into [top, bottom)
+  int64_t row_begin = max((top - ctx->ink_bottom) / SN_LINE_HEIGHT, 0);
+  int64_t row_end = min((bottom - ctx->ink_top) / SN_LINE_HEIGHT + 1, (int64_t)ctx->rows);
+
+  if (tile->spans == NULL) {
+    sn_fill(&tile->bitmap, ctx->fill_color);
+  } else {
+    sn_span_tile(ctx, tile, row_begin, row_end);
+  }
+
+  for (int64_t r = row_begin; r < row_end; r++) {
+    for (uint32_t k = ctx->row_start[r]; k < ctx->row_start[r + 1]; k++) {
+      const sn_run_t* run = &ctx->runs[ctx->row_index[k]];
+
+      for (uint32_t i = 0; i < run->count; i++) {
+        const sn_placement_t* placement = &ctx->placements[run->first + i];
+        const sn_glyph_t* glyph = &ctx->glyphs.glyphs[placement->glyph];
+
+        if (glyph->buffer == NULL) continue;
+
+        int64_t off_x = (int64_t)placement->x + glyph->bearing_x + ctx->origin_x;
+        int64_t off_y = r * SN_LINE_HEIGHT + SN_FONT_SIZE - glyph->bearing_y + ctx->origin_y;
+
+        sn_blit_glyph(tile, glyph, off_x, off_y, run->color);
+      }
+    }
+  }
+}
+
 SN_API void sn_set_font(sn_ctx ctx, sn_font_type font_type) {
   assert(SN_FONT_TYPES > font_type);
   ctx->font_type = font_type;
@@ -311,20 +804,8 @@ struct sn_writer_state_s {
   sn_error err;
 } typedef sn_writer_state_t;
 
-size_t grow_capacity(size_t curr, size_t minimum) {
-  size_t new_cap = curr;
-  static const size_t init_capacity = 64; // todd: get progromaticly we can use zig for that
-
-  while (1) {
-    new_cap += new_cap / 2 + init_capacity;
-    if (new_cap >= minimum)
-      return new_cap;
-  }
-}
-
-void sn_output_writer_write(png_structp ptr, uint8_t* buf, size_t buf_len) {
+void sn_writer_write(sn_writer_state_t* state, const void* buf, size_t buf_len) {
   if (buf_len == 0) return;
-  sn_writer_state_t* state = png_get_io_ptr(ptr);
 
   assert(buf != NULL);
   assert(state != NULL);
@@ -333,32 +814,17 @@ void sn_output_writer_write(png_structp ptr, uint8_t* buf, size_t buf_len) {
     return;
   }
 
-  // do some logic here like vector store capacity and do some growing
-  // we rely need to doing it would make generating the image like 20-25% faster
-  if (state->out_len + buf_len > state->out_cap) {
-    size_t new_cap = grow_capacity(state->out_cap, state->out_len + buf_len);
-
-    uint8_t* old = state->out;
-    uint8_t* new = malloc(new_cap);
-
-    if (new == NULL) {
-      free(state->out);
-
-      state->out = NULL;
-      state->out_len = 0;
-      state->out_cap = 0;
-      state->err = FT_Err_Out_Of_Memory;
-
-      return;
-    }
+  // realloc can usually grow in place, which matters once whole file snips are megabytes of png
+  sn_error err = sn_reserve((void**)&state->out, &state->out_cap, state->out_len + buf_len, 1);
+  if (err != 0) {
+    free(state->out);
 
-    if (old != NULL) {
-      memcpy(new, old, state->out_len);
-      free(old);
-    }
+    state->out = NULL;
+    state->out_len = 0;
+    state->out_cap = 0;
+    state->err = err;
 
-    state->out = new;
-    state->out_cap = new_cap;
+    return;
   }
 
   assert(state->out != NULL);
@@ -366,88 +832,905 @@ void sn_output_writer_write(png_structp ptr, uint8_t* buf, size_t buf_len) {
   state->out_len += buf_len;
 }
 
-SN_API sn_error sn_output(sn_ctx ctx, uint8_t** dist, size_t* dist_len) {
-  assert(dist != NULL);
-  assert(dist_len != NULL);
+void sn_writer_print(sn_writer_state_t* state, const char* fmt, ...) {
+  char buf[256];
 
-  assert(ctx->bitmap.buffer != NULL);
-  assert(ctx->bitmap.width > 0);
-  assert(ctx->bitmap.height > 0);
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
 
-  sn_error err;
+  // everything we print is way shorter than that
+  assert(len >= 0 && (size_t)len < sizeof(buf));
 
-  png_structp writer = NULL;
-  png_infop info = NULL;
+  sn_writer_write(state, buf, len);
+}
 
-  writer = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-  if (writer == NULL) {
-    err = FT_Err_Out_Of_Memory;
-    goto err;
+struct sn_raster_job_s {
+  sn_ctx ctx;
+  sn_tile_t* tiles;
+  uint32_t bands; // per tile
+  uint32_t band_height;
+} typedef sn_raster_job_t;
+
+// a band is a view into its tile's buffer, bands write disjoint scanlines and
+// clip overhanging glyphs of neighbouring lines to themselves, so no locking is needed
+void sn_raster_task(void* arg, uint32_t idx) {
+  sn_raster_job_t* job = arg;
+  sn_tile_t* tile = &job->tiles[idx / job->bands];
+
+  uint32_t off = (idx % job->bands) * job->band_height;
+  if (off >= tile->bitmap.height) {
+    return;
   }
 
-  info = png_create_info_struct(writer);
-  if (info == NULL) {
-    goto err;
-  }
+  sn_tile_t band;
+  band.y = tile->y + off;
+  band.bitmap.width = tile->bitmap.width;
+  band.bitmap.height = min(job->band_height, tile->bitmap.height - off);
+  band.bitmap.buffer = tile->bitmap.buffer + (size_t)off * tile->bitmap.width * 3;
+  band.spans = tile->spans != NULL ? tile->spans + off : NULL;
 
-  if (setjmp(png_jmpbuf(writer))) {
-    err = FT_Err_Out_Of_Memory; // is this true?
-    goto err;
+  sn_rasterize_tile(job->ctx, &band);
+}
+
+// rasterizes tiles_len tiles splitting them into line bands so that every thread gets work
+void sn_rasterize(sn_ctx ctx, sn_tile_t* tiles, uint32_t tiles_len) {
+  uint32_t lines = 0;
+  for (uint32_t i = 0; i < tiles_len; i++) {
+    lines = max(lines, tiles[i].bitmap.height / SN_LINE_HEIGHT + (tiles[i].bitmap.height % SN_LINE_HEIGHT != 0));
   }
 
-  sn_writer_state_t write_state = (sn_writer_state_t){ NULL, 0, 0, 0 };
+  // twice as many bands as threads evens out lines with more text
+  uint32_t bands = 1;
+  if (ctx->threads > 1) {
+    bands = min(max((ctx->threads * 2) / tiles_len, 1), max(lines, 1));
+  }
 
-  png_set_compression_level(writer, Z_BEST_SPEED);
-  png_set_compression_strategy(writer, Z_RLE);
-  png_set_filter(writer, 0, PNG_FILTER_SUB);
+  uint32_t band_lines = lines / bands + (lines % bands != 0);
 
-  png_set_write_fn(writer, &write_state, &sn_output_writer_write, NULL);
-  png_set_IHDR(writer, info, ctx->bitmap.width, ctx->bitmap.height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+  sn_raster_job_t job;
+  job.ctx = ctx;
+  job.tiles = tiles;
+  job.bands = bands;
+  job.band_height = max(band_lines, 1) * SN_LINE_HEIGHT;
 
-  png_write_info(writer, info);
+  sn_parallel_for(ctx->threads, tiles_len * bands, &sn_raster_task, &job);
+}
 
-  for (uint32_t i = 0; i < ctx->bitmap.height; i++) {
-    png_const_bytep row = ctx->bitmap.buffer + (i * ctx->bitmap.width * 3);
-    png_write_row(writer, row); // todo: try to oneshot it with that write_image mb result will be smaller
-    err = write_state.err;
-    if (err != 0) {
-      goto err;
-    }
-  }
+// previews bigger than this many pixels are scaled down, they end up in a float anyway
+#define SN_PREVIEW_MAX_PIXELS (4096 * 4096)
 
-  png_write_end(writer, NULL);
+// canvas scanlines rasterized at once while scaling a preview down
+#define SN_PREVIEW_TILE_HEIGHT 256
 
-  err = write_state.err;
-  if (err != 0) {
-    goto err;
-  }
+// averages factor x factor blocks of tile into dst, whose rows start at the tile's y / factor
+void sn_preview_downscale(const sn_tile_t* tile, uint32_t factor, uint8_t* dst, uint32_t dst_width) {
+  uint32_t dst_rows = tile->bitmap.height / factor + (tile->bitmap.height % factor != 0);
 
-  png_destroy_write_struct(&writer, &info);
+  for (uint32_t dy = 0; dy < dst_rows; dy++) {
+    uint32_t y0 = dy * factor;
+    uint32_t y1 = min(y0 + factor, tile->bitmap.height);
 
-  *dist = write_state.out;
-  *dist_len = write_state.out_len;
+    uint8_t* out = dst + ((size_t)(tile->y / factor + dy) * dst_width) * 3;
 
-  free(ctx->bitmap.buffer);
-  ctx->bitmap.buffer = NULL;
-  ctx->bitmap.width = 0;
-  ctx->bitmap.height = 0;
+    for (uint32_t dx = 0; dx < dst_width; dx++) {
+      uint32_t x0 = dx * factor;
+      uint32_t x1 = min(x0 + factor, tile->bitmap.width);
 
-  return 0;
+      uint32_t sum[3] = { 0, 0, 0 };
+      for (uint32_t y = y0; y < y1; y++) {
+        const uint8_t* src = tile->bitmap.buffer + ((size_t)y * tile->bitmap.width + x0) * 3;
+        for (uint32_t x = x0; x < x1; x++) {
+          sum[0] += *src++;
+          sum[1] += *src++;
+          sum[2] += *src++;
+        }
+      }
+
+      uint32_t count = (y1 - y0) * (x1 - x0);
+      *out++ = sum[0] / count;
+      *out++ = sum[1] / count;
+      *out++ = sum[2] / count;
+    }
+  }
+}
+
+// rasterizes the canvas as raw rgb into a new posix shared memory object, so a terminal can show it
+// without any encoding, canvases above SN_PREVIEW_MAX_PIXELS are scaled down by a whole factor and
+// width, height are the size that was written. the canvas is kept so sn_output can still be called
+// once the preview is confirmed, and the object must be removed with sn_preview_release
+SN_API sn_error sn_preview(sn_ctx ctx, const char* name, uint32_t* width, uint32_t* height) {
+  assert(ctx != NULL);
+  assert(name != NULL);
+  assert(width != NULL);
+  assert(height != NULL);
+
+  assert(ctx->width > 0);
+  assert(ctx->height > 0);
+
+#ifdef _WIN32
+  return FT_Err_Unimplemented_Feature;
+#else
+  sn_error err;
+
+  uint32_t factor = 1;
+  uint64_t out_width = ctx->width;
+  uint64_t out_height = ctx->height;
+
+  while (out_width * out_height > SN_PREVIEW_MAX_PIXELS) {
+    factor++;
+    out_width = ctx->width / factor + (ctx->width % factor != 0);
+    out_height = ctx->height / factor + (ctx->height % factor != 0);
+  }
+
+  size_t len = out_width * out_height * 3;
+
+  // whole factor blocks of lines, so blocks never straddle two tiles
+  uint32_t tile_height = factor * max(SN_PREVIEW_TILE_HEIGHT / factor, 1);
+  if (factor > 1 && (uint64_t)ctx->width * tile_height * 3 > SIZE_MAX) {
+    return FT_Err_Array_Too_Large;
+  }
+
+  err = sn_build_index(ctx);
+  if (err != 0) {
+    return err;
+  }
+
+  uint8_t* buffer = MAP_FAILED;
+  sn_tile_t tile;
+  tile.bitmap.buffer = NULL;
+
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) {
+    return FT_Err_Cannot_Open_Resource;
+  }
+
+  // ftruncate alone leaves a sparse tmpfs file and writing to it raises SIGBUS once /dev/shm is full
+#ifdef __APPLE__
+  if (ftruncate(fd, len) != 0) {
+#else
+  if (posix_fallocate(fd, 0, len) != 0) {
+#endif
+    err = FT_Err_Out_Of_Memory;
+    goto err;
+  }
+
+  buffer = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (buffer == MAP_FAILED) {
+    err = FT_Err_Out_Of_Memory;
+    goto err;
+  }
+
+  tile.spans = NULL; // terminal needs every pixel
+
+  if (factor == 1) {
+    tile.bitmap = (sn_bitmap_t){ buffer, ctx->width, ctx->height };
+    tile.y = 0;
+
+    sn_rasterize(ctx, &tile, 1);
+  } else {
+    tile.bitmap.width = ctx->width;
+    tile.bitmap.buffer = malloc((size_t)ctx->width * tile_height * 3);
+    if (tile.bitmap.buffer == NULL) {
+      err = FT_Err_Out_Of_Memory;
+      goto err;
+    }
+
+    for (tile.y = 0; tile.y < ctx->height; tile.y += tile_height) {
+      tile.bitmap.height = min(tile_height, ctx->height - tile.y);
+
+      sn_rasterize(ctx, &tile, 1);
+      sn_preview_downscale(&tile, factor, buffer, out_width);
+    }
+
+    free(tile.bitmap.buffer);
+  }
+
+  munmap(buffer, len);
+  close(fd);
+
+  *width = out_width;
+  *height = out_height;
+
+  return 0;
 
 err:
-  assert(write_state.out == NULL);
-  assert(write_state.out_len == 0);
+  if (buffer != MAP_FAILED) {
+    munmap(buffer, len);
+  }
+
+  close(fd);
+  shm_unlink(name);
+
+  return err;
+#endif
+}
+
+// removes a preview's shared memory object, kitty unlinks it itself after reading it
+// but nothing tells us it did, so this is called once the preview is closed either way
+SN_API sn_error sn_preview_release(const char* name) {
+  assert(name != NULL);
+
+#ifdef _WIN32
+  return FT_Err_Unimplemented_Feature;
+#else
+  if (shm_unlink(name) != 0 && errno != ENOENT) {
+    return FT_Err_Cannot_Open_Resource;
+  }
+  return 0;
+#endif
+}
+
+// how far below the top of a line images are cut, the descenders of the line above reach
+// this far into it and everything drawn is at least this low, so the cut crosses no ink
+int64_t sn_part_shift(sn_ctx ctx) {
+  return min(max((int64_t)ctx->ink_bottom - SN_LINE_HEIGHT, 0), SN_LINE_HEIGHT - 1);
+}
+
+// height of the lines in a single output image, images are cut between lines (at origin_y
+// plus a multiple of this plus the shift) so the first and last one also carry the padding,
+// 0 means one image
+int64_t sn_part_span(sn_ctx ctx) {
+  if (ctx->max_height == 0 || ctx->max_height >= ctx->height) {
+    return 0;
+  }
+
+  // whatever is above the first line and below the last one, the first image also
+  // takes the shift of its cut and the last one gives it up
+  int64_t top = max((int64_t)ctx->origin_y, 0);
+  int64_t bottom = max((int64_t)ctx->height - ctx->origin_y - (int64_t)ctx->rows * SN_LINE_HEIGHT, 0);
+
+  int64_t lines = max(((int64_t)ctx->max_height - top - bottom - sn_part_shift(ctx)) / SN_LINE_HEIGHT, 1);
+  return lines * SN_LINE_HEIGHT;
+}
+
+// canvas y where part starts, ends where the next one starts
+int64_t sn_part_y(sn_ctx ctx, int64_t span, uint32_t part) {
+  if (part == 0) {
+    return 0;
+  }
+  return max((int64_t)ctx->origin_y + part * span + sn_part_shift(ctx), 0);
+}
+
+SN_API uint32_t sn_output_count(sn_ctx ctx) {
+  assert(ctx != NULL);
+  assert(ctx->height > 0);
+
+  int64_t span = sn_part_span(ctx);
+  if (span == 0) {
+    return 1;
+  }
+
+  // cuts at origin_y + k * span + shift for k >= 1 that fall before the end of the last
+  // line, the bottom padding stays with the last image
+  int64_t inside = min((int64_t)ctx->height - ctx->origin_y - sn_part_shift(ctx), (int64_t)ctx->rows * SN_LINE_HEIGHT) - 1;
+  return inside > 0 ? inside / span + 1 : 1;
+}
+
+// idat chunks are cut at this size
+#define SN_IDAT_SIZE (1 << 16)
+
+// blank scanlines are spliced in as precompressed blocks of these many rows, largest first
+#define SN_BLANK_BLOCKS 3
+static const uint32_t sn_blank_rows[SN_BLANK_BLOCKS] = { 64, 8, 1 };
+
+// we write the png ourselves so rows can be fed already filtered, and runs of
+// rows that are just fill_color skip both filtering and deflate entirely
+struct sn_png_s {
+  sn_writer_state_t out;
+
+  z_stream stream; // raw deflate, the zlib header and adler32 are ours
+  bool stream_init;
+  bool dirty; // input since the last full flush
+  uLong adler;
+
+  uint8_t* idat;
+  size_t idat_len;
+
+  uint32_t width;
+  sn_color_t fill;
+
+  // a fill_color row filtered with sub: 1, r, g, b and zeros, row_len is 1 + width * 3
+  uint8_t* blank;
+  size_t row_len;
+  uint8_t* scratch; // filtered span of a single row
+
+  // blank rows deflated on their own and ended with a full flush, so they
+  // can be copied into the stream whenever it is byte aligned with no history
+  uint8_t* blank_z[SN_BLANK_BLOCKS];
+  size_t blank_z_len[SN_BLANK_BLOCKS];
+  uLong blank_adler[SN_BLANK_BLOCKS];
+} typedef sn_png_t;
+
+void sn_png_u32(uint8_t* dst, uint32_t v) {
+  dst[0] = v >> 24;
+  dst[1] = v >> 16;
+  dst[2] = v >> 8;
+  dst[3] = v;
+}
+
+void sn_png_chunk(sn_writer_state_t* out, const char* type, const uint8_t* data, uint32_t len) {
+  uint8_t header[8];
+  sn_png_u32(header, len);
+  memcpy(header + 4, type, 4);
+
+  uLong crc = crc32(0, (const Bytef*)type, 4);
+  if (len > 0) {
+    crc = crc32(crc, data, len);
+  }
+
+  uint8_t footer[4];
+  sn_png_u32(footer, crc);
+
+  sn_writer_write(out, header, sizeof(header));
+  sn_writer_write(out, data, len);
+  sn_writer_write(out, footer, sizeof(footer));
+}
+
+void sn_png_idat(sn_png_t* png, const uint8_t* data, size_t len) {
+  while (len > 0) {
+    size_t n = min(len, SN_IDAT_SIZE - png->idat_len);
+    memcpy(png->idat + png->idat_len, data, n);
+    png->idat_len += n;
+    data += n;
+    len -= n;
+
+    if (png->idat_len == SN_IDAT_SIZE) {
+      sn_png_chunk(&png->out, "IDAT", png->idat, png->idat_len);
+      png->idat_len = 0;
+    }
+  }
+}
+
+// runs deflate over data and hands everything it produced to sink
+sn_error sn_deflate(z_stream* stream, const uint8_t* data, size_t len, int flush, void (*sink)(void*, const uint8_t*, size_t), void* user) {
+  uint8_t buf[1 << 14];
+
+  stream->next_in = (Bytef*)data;
+  stream->avail_in = len;
+
+  do {
+    stream->next_out = buf;
+    stream->avail_out = sizeof(buf);
+
+    int ret = deflate(stream, flush);
+    if (ret == Z_STREAM_ERROR) {
+      return FT_Err_Invalid_Argument;
+    }
+
+    sink(user, buf, sizeof(buf) - stream->avail_out);
+  } while (stream->avail_out == 0 || stream->avail_in > 0);
+
+  return 0;
+}
+
+void sn_png_sink(void* user, const uint8_t* data, size_t len) {
+  sn_png_idat(user, data, len);
+}
+
+void sn_writer_sink(void* user, const uint8_t* data, size_t len) {
+  sn_writer_write(user, data, len);
+}
+
+sn_error sn_png_write(sn_png_t* png, const uint8_t* data, size_t len) {
+  if (len == 0) {
+    return 0;
+  }
+
+  png->adler = adler32(png->adler, data, len);
+  png->dirty = true;
+
+  return sn_deflate(&png->stream, data, len, Z_NO_FLUSH, &sn_png_sink, png);
+}
+
+sn_error sn_png_compress_blank(sn_png_t* png, uint32_t idx) {
+  sn_error err = 0;
+  sn_writer_state_t out = (sn_writer_state_t){ NULL, 0, 0, 0 };
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+
+  if (deflateInit2(&stream, Z_BEST_SPEED, Z_DEFLATED, -15, 8, Z_RLE) != Z_OK) {
+    return FT_Err_Out_Of_Memory;
+  }
+
+  png->blank_adler[idx] = adler32(0, NULL, 0);
+
+  for (uint32_t i = 0; i < sn_blank_rows[idx] && err == 0; i++) {
+    png->blank_adler[idx] = adler32(png->blank_adler[idx], png->blank, png->row_len);
+    err = sn_deflate(&stream, png->blank, png->row_len, Z_NO_FLUSH, &sn_writer_sink, &out);
+  }
+
+  if (err == 0) {
+    err = sn_deflate(&stream, NULL, 0, Z_FULL_FLUSH, &sn_writer_sink, &out);
+  }
+
+  deflateEnd(&stream);
+
+  if (err == 0) {
+    err = out.err;
+  }
+
+  if (err != 0) {
+    free(out.out);
+    return err;
+  }
+
+  png->blank_z[idx] = out.out;
+  png->blank_z_len[idx] = out.out_len;
+
+  return 0;
+}
+
+sn_error sn_png_init(sn_png_t* png, uint32_t width, uint32_t height, sn_color_t fill) {
+  sn_error err;
+
+  memset(png, 0, sizeof(sn_png_t));
+
+  png->width = width;
+  png->fill = fill;
+  png->row_len = 1 + (size_t)width * 3;
+  png->adler = adler32(0, NULL, 0);
+
+  png->idat = malloc(SN_IDAT_SIZE);
+  png->blank = calloc(png->row_len, 1);
+  png->scratch = malloc(png->row_len);
+
+  if (png->idat == NULL || png->blank == NULL || png->scratch == NULL) {
+    return FT_Err_Out_Of_Memory;
+  }
+
+  png->blank[0] = 1; // sub
+  png->blank[1] = fill.r;
+  png->blank[2] = fill.g;
+  png->blank[3] = fill.b;
+
+  for (uint32_t i = 0; i < SN_BLANK_BLOCKS; i++) {
+    err = sn_png_compress_blank(png, i);
+    if (err != 0) {
+      return err;
+    }
+  }
+
+  if (deflateInit2(&png->stream, Z_BEST_SPEED, Z_DEFLATED, -15, 8, Z_RLE) != Z_OK) {
+    return FT_Err_Out_Of_Memory;
+  }
+  png->stream_init = true;
+
+  static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+  sn_writer_write(&png->out, signature, sizeof(signature));
+
+  uint8_t ihdr[13];
+  sn_png_u32(ihdr, width);
+  sn_png_u32(ihdr + 4, height);
+  ihdr[8] = 8; // bit depth
+  ihdr[9] = 2; // rgb
+  ihdr[10] = 0; // deflate
+  ihdr[11] = 0; // adaptive filtering
+  ihdr[12] = 0; // no interlace
+  sn_png_chunk(&png->out, "IHDR", ihdr, sizeof(ihdr));
+
+  // zlib header for deflate with a 32K window at the fastest level
+  static const uint8_t zlib_header[2] = { 0x78, 0x01 };
+  sn_png_idat(png, zlib_header, sizeof(zlib_header));
+
+  return png->out.err;
+}
+
+void sn_png_deinit(sn_png_t* png) {
+  if (png->stream_init) {
+    deflateEnd(&png->stream);
+  }
+
+  free(png->idat);
+  free(png->blank);
+  free(png->scratch);
+  for (uint32_t i = 0; i < SN_BLANK_BLOCKS; i++) {
+    free(png->blank_z[i]);
+  }
+}
+
+// appends count rows of fill_color
+sn_error sn_png_blank(sn_png_t* png, uint32_t count) {
+  sn_error err;
+
+  if (count == 0) {
+    return 0;
+  }
+
+  // splicing needs a byte aligned stream that doesn't reference anything before it
+  if (png->dirty) {
+    err = sn_deflate(&png->stream, NULL, 0, Z_FULL_FLUSH, &sn_png_sink, png);
+    if (err != 0) {
+      return err;
+    }
+    png->dirty = false;
+  }
+
+  for (uint32_t i = 0; i < SN_BLANK_BLOCKS; i++) {
+    while (count >= sn_blank_rows[i]) {
+      sn_png_idat(png, png->blank_z[i], png->blank_z_len[i]);
+      png->adler = adler32_combine(png->adler, png->blank_adler[i], (z_off_t)png->row_len * sn_blank_rows[i]);
+      count -= sn_blank_rows[i];
+    }
+  }
+
+  return 0;
+}
+
+// appends a row where only span holds pixels, everything around it is fill_color
+sn_error sn_png_row(sn_png_t* png, const uint8_t* row, sn_span_t span) {
+  sn_error err;
+
+  if (span.x0 >= span.x1) {
+    return sn_png_blank(png, 1);
+  }
+
+  uint8_t prev[3] = { png->fill.r, png->fill.g, png->fill.b };
 
-  if (writer != NULL) {
-    png_destroy_write_struct(&writer, info != NULL ? &info : NULL);
+  // filter byte, first fill pixel and zeros up to the span
+  if (span.x0 == 0) {
+    memset(prev, 0, sizeof(prev));
+    err = sn_png_write(png, png->blank, 1);
   } else {
-    assert(info == NULL);
+    err = sn_png_write(png, png->blank, 1 + (size_t)span.x0 * 3);
   }
+  if (err != 0) {
+    return err;
+  }
+
+  const uint8_t* src = row + (size_t)span.x0 * 3;
+  uint8_t* dst = png->scratch;
+
+  for (uint32_t x = span.x0; x < span.x1; x++) {
+    dst[0] = src[0] - prev[0];
+    dst[1] = src[1] - prev[1];
+    dst[2] = src[2] - prev[2];
+
+    prev[0] = src[0];
+    prev[1] = src[1];
+    prev[2] = src[2];
+
+    src += 3;
+    dst += 3;
+  }
+
+  if (span.x1 < png->width) {
+    dst[0] = png->fill.r - prev[0];
+    dst[1] = png->fill.g - prev[1];
+    dst[2] = png->fill.b - prev[2];
+    dst += 3;
+  }
+
+  err = sn_png_write(png, png->scratch, dst - png->scratch);
+  if (err != 0) {
+    return err;
+  }
+
+  // past the span everything is zero again, blank has enough of those after its first pixel
+  if (span.x1 + 1 < png->width) {
+    err = sn_png_write(png, png->blank + 4, (size_t)(png->width - span.x1 - 1) * 3);
+  }
+
+  return err;
+}
+
+sn_error sn_png_end(sn_png_t* png) {
+  sn_error err = sn_deflate(&png->stream, NULL, 0, Z_FINISH, &sn_png_sink, png);
+  if (err != 0) {
+    return err;
+  }
+
+  uint8_t adler[4];
+  sn_png_u32(adler, png->adler);
+  sn_png_idat(png, adler, sizeof(adler));
+
+  if (png->idat_len > 0) {
+    sn_png_chunk(&png->out, "IDAT", png->idat, png->idat_len);
+    png->idat_len = 0;
+  }
+
+  sn_png_chunk(&png->out, "IEND", NULL, 0);
+
+  return png->out.err;
+}
+
+// tiles rasterized together while encoding stay under this many bytes, a single tile may
+// go over it, sn_rasterize splits the tiles into line bands so fewer tiles still use every thread
+#define SN_TILE_BUDGET (32 << 20)
+
+// encodes canvas scanlines [y0, y1) as a png
+sn_error sn_encode(sn_ctx ctx, uint32_t y0, uint32_t y1, uint8_t** dist, size_t* dist_len) {
+  assert(y1 > y0);
+
+  sn_error err;
+
+  uint32_t height = y1 - y0;
+  uint32_t tile_height = height;
+  uint32_t batch = 1;
+
+  if (ctx->tile_rows > 0 && (uint64_t)ctx->tile_rows * SN_LINE_HEIGHT < height) {
+    tile_height = ctx->tile_rows * SN_LINE_HEIGHT;
+    batch = min(max(ctx->threads, 1), max(SN_TILE_BUDGET / ((uint64_t)ctx->width * 3 * tile_height), 1));
+  }
+
+  uint32_t tiles_len = height / tile_height + (height % tile_height != 0);
+  batch = min(batch, tiles_len);
+
+  if ((uint64_t)ctx->width * 3 * tile_height > SIZE_MAX / batch) {
+    return FT_Err_Array_Too_Large;
+  }
+
+  err = sn_build_index(ctx);
+  if (err != 0) {
+    return err;
+  }
+
+  sn_png_t png;
+  memset(&png, 0, sizeof(png));
+
+  sn_tile_t* tiles = calloc(batch, sizeof(sn_tile_t));
+  if (tiles == NULL) {
+    return FT_Err_Out_Of_Memory;
+  }
+
+  // untouched pages of these are never faulted in
+  for (uint32_t i = 0; i < batch; i++) {
+    tiles[i].bitmap.width = ctx->width;
+    tiles[i].bitmap.buffer = malloc((size_t)ctx->width * tile_height * 3);
+    tiles[i].spans = malloc(tile_height * sizeof(sn_span_t));
+    if (tiles[i].bitmap.buffer == NULL || tiles[i].spans == NULL) {
+      err = FT_Err_Out_Of_Memory;
+      goto err;
+    }
+  }
+
+  err = sn_png_init(&png, ctx->width, height, ctx->fill_color);
+  if (err != 0) {
+    goto err;
+  }
+
+  for (uint32_t t = 0; t < tiles_len; t += batch) {
+    uint32_t n = min(batch, tiles_len - t);
+
+    for (uint32_t i = 0; i < n; i++) {
+      sn_tile_t* tile = &tiles[i];
+      tile->y = y0 + (t + i) * tile_height;
+      tile->bitmap.height = min(tile_height, y1 - tile->y);
+    }
+
+    sn_rasterize(ctx, tiles, n);
+
+    for (uint32_t i = 0; i < n; i++) {
+      sn_tile_t* tile = &tiles[i];
+      uint32_t blank = 0;
+
+      for (uint32_t y = 0; y < tile->bitmap.height; y++) {
+        if (tile->spans[y].x0 >= tile->spans[y].x1) {
+          blank++;
+          continue;
+        }
+
+        err = sn_png_blank(&png, blank);
+        if (err != 0) {
+          goto err;
+        }
+        blank = 0;
+
+        err = sn_png_row(&png, tile->bitmap.buffer + (size_t)y * tile->bitmap.width * 3, tile->spans[y]);
+        if (err != 0) {
+          goto err;
+        }
+      }
+
+      err = sn_png_blank(&png, blank);
+      if (err != 0) {
+        goto err;
+      }
+    }
+  }
+
+  err = sn_png_end(&png);
+  if (err != 0) {
+    goto err;
+  }
+
+  *dist = png.out.out;
+  *dist_len = png.out.out_len;
+  png.out.out = NULL;
+
+  err = 0;
+
+err:
+  free(png.out.out);
+  sn_png_deinit(&png);
+
+  for (uint32_t i = 0; i < batch; i++) {
+    free(tiles[i].bitmap.buffer);
+    free(tiles[i].spans);
+  }
+  free(tiles);
+
+  return err;
+}
+
+// encodes one of sn_output_count images, the canvas is kept so call sn_clear when done
+SN_API sn_error sn_output_part(sn_ctx ctx, uint32_t part, uint8_t** dist, size_t* dist_len) {
+  assert(dist != NULL);
+  assert(dist_len != NULL);
+
+  assert(ctx->width > 0);
+  assert(ctx->height > 0);
 
-  free(ctx->bitmap.buffer);
-  ctx->bitmap.buffer = NULL;
-  ctx->bitmap.width = 0;
-  ctx->bitmap.height = 0;
+  int64_t span = sn_part_span(ctx);
+  uint32_t count = sn_output_count(ctx);
+  assert(count > part);
+
+  uint32_t y0 = sn_part_y(ctx, span, part);
+  uint32_t y1 = part + 1 == count ? ctx->height : sn_part_y(ctx, span, part + 1);
+
+  return sn_encode(ctx, y0, y1, dist, dist_len);
+}
+
+// encodes the whole canvas as a single image and clears it
+SN_API sn_error sn_output(sn_ctx ctx, uint8_t** dist, size_t* dist_len) {
+  assert(dist != NULL);
+  assert(dist_len != NULL);
+
+  assert(ctx->width > 0);
+  assert(ctx->height > 0);
+
+  sn_error err = sn_encode(ctx, 0, ctx->height, dist, dist_len);
+  sn_clear(ctx);
+
+  return err;
+}
+
+// svg coordinates are in pixels with y going down, outlines are 26.6 with y going up
+#define SN_SVG_X(v) ((v) / 64.0)
+#define SN_SVG_Y(v) (-(v) / 64.0)
+
+int sn_svg_move_to(const FT_Vector* to, void* user) {
+  sn_writer_print(user, "M%g %g", SN_SVG_X(to->x), SN_SVG_Y(to->y));
+  return 0;
+}
+
+int sn_svg_line_to(const FT_Vector* to, void* user) {
+  sn_writer_print(user, "L%g %g", SN_SVG_X(to->x), SN_SVG_Y(to->y));
+  return 0;
+}
+
+int sn_svg_conic_to(const FT_Vector* control, const FT_Vector* to, void* user) {
+  sn_writer_print(user, "Q%g %g %g %g", SN_SVG_X(control->x), SN_SVG_Y(control->y), SN_SVG_X(to->x), SN_SVG_Y(to->y));
+  return 0;
+}
+
+int sn_svg_cubic_to(const FT_Vector* control1, const FT_Vector* control2, const FT_Vector* to, void* user) {
+  sn_writer_print(user, "C%g %g %g %g %g %g",
+    SN_SVG_X(control1->x), SN_SVG_Y(control1->y),
+    SN_SVG_X(control2->x), SN_SVG_Y(control2->y),
+    SN_SVG_X(to->x), SN_SVG_Y(to->y));
+  return 0;
+}
+
+// writes the outline of a cached glyph as a path, glyphs without one (spaces, bitmaps) return false
+sn_error sn_svg_glyph(sn_ctx ctx, sn_writer_state_t* state, uint32_t idx, bool* has_outline) {
+  static const FT_Outline_Funcs funcs = {
+    .move_to = &sn_svg_move_to,
+    .line_to = &sn_svg_line_to,
+    .conic_to = &sn_svg_conic_to,
+    .cubic_to = &sn_svg_cubic_to,
+    .shift = 0,
+    .delta = 0,
+  };
+
+  const sn_glyph_t* glyph = &ctx->glyphs.glyphs[idx];
+  FT_Face face = ctx->fonts[glyph->font_type];
+  FT_Error err;
+
+  *has_outline = false;
+
+  // unhinted outlines stay true to the font at any zoom
+  err = FT_Load_Glyph(face, glyph->index, FT_LOAD_NO_BITMAP | FT_LOAD_NO_HINTING);
+  if (err != FT_Err_Ok) {
+    return err;
+  }
+
+  if (face->glyph->format != FT_GLYPH_FORMAT_OUTLINE || face->glyph->outline.n_contours == 0) {
+    return 0;
+  }
+
+  sn_writer_print(state, "<path id=\"g%u\" d=\"", idx);
+
+  err = FT_Outline_Decompose(&face->glyph->outline, &funcs, state);
+  if (err != FT_Err_Ok) {
+    return err;
+  }
+
+  sn_writer_print(state, "Z\"/>\n");
+
+  *has_outline = true;
+  return 0;
+}
+
+// writes the canvas as an svg where every glyph outline is defined once and placed with <use>, then clears it
+SN_API sn_error sn_output_svg(sn_ctx ctx, uint8_t** dist, size_t* dist_len) {
+  assert(dist != NULL);
+  assert(dist_len != NULL);
+
+  assert(ctx->width > 0);
+  assert(ctx->height > 0);
+
+  sn_error err = 0;
+  sn_writer_state_t write_state = (sn_writer_state_t){ NULL, 0, 0, 0 };
+
+  // 0 not used yet, 1 defined, 2 has nothing to draw
+  uint8_t* defined = calloc(max(ctx->glyphs.len, 1), sizeof(uint8_t));
+  if (defined == NULL) {
+    err = FT_Err_Out_Of_Memory;
+    goto err;
+  }
+
+  sn_writer_print(&write_state,
+    "<svg xmlns=\"http://www.w3.org/2000/svg\" xmlns:xlink=\"http://www.w3.org/1999/xlink\" width=\"%u\" height=\"%u\" viewBox=\"0 0 %u %u\">\n",
+    ctx->width, ctx->height, ctx->width, ctx->height);
+
+  sn_writer_print(&write_state, "<defs>\n");
+
+  for (size_t i = 0; i < ctx->placements_len; i++) {
+    uint32_t idx = ctx->placements[i].glyph;
+    if (defined[idx] != 0) continue;
+
+    bool has_outline;
+    err = sn_svg_glyph(ctx, &write_state, idx, &has_outline);
+    if (err != 0) {
+      goto err;
+    }
+
+    defined[idx] = has_outline ? 1 : 2;
+  }
+
+  sn_writer_print(&write_state, "</defs>\n");
+
+  sn_writer_print(&write_state, "<rect width=\"100%%\" height=\"100%%\" fill=\"#%02x%02x%02x\"/>\n",
+    ctx->fill_color.r, ctx->fill_color.g, ctx->fill_color.b);
+
+  for (size_t i = 0; i < ctx->runs_len; i++) {
+    const sn_run_t* run = &ctx->runs[i];
+    int64_t baseline = (int64_t)run->row * SN_LINE_HEIGHT + SN_FONT_SIZE + ctx->origin_y;
+
+    sn_writer_print(&write_state, "<g fill=\"#%02x%02x%02x\">", run->color.r, run->color.g, run->color.b);
+
+    for (uint32_t k = 0; k < run->count; k++) {
+      const sn_placement_t* placement = &ctx->placements[run->first + k];
+      if (defined[placement->glyph] != 1) continue;
+
+      sn_writer_print(&write_state, "<use xlink:href=\"#g%u\" x=\"%lld\" y=\"%lld\"/>", placement->glyph, (long long)placement->x + ctx->origin_x, (long long)baseline);
+    }
+
+    sn_writer_print(&write_state, "</g>\n");
+  }
+
+  sn_writer_print(&write_state, "</svg>\n");
+
+  err = write_state.err;
+  if (err != 0) {
+    goto err;
+  }
+
+  free(defined);
+  sn_clear(ctx);
+
+  *dist = write_state.out;
+  *dist_len = write_state.out_len;
+
+  return 0;
+
+err:
+  free(write_state.out);
+  free(defined);
+  sn_clear(ctx);
 
   return err;
 }
@@ -0,0 +1,96 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "thread.h"
+
+#ifdef _WIN32
+typedef HANDLE sn_thread_t;
+#else
+typedef pthread_t sn_thread_t;
+#endif
+
+struct sn_parallel_s {
+  sn_task_fn fn;
+  void* arg;
+  uint32_t count;
+  atomic_uint next;
+} typedef sn_parallel_t;
+
+void sn_parallel_run(sn_parallel_t* job) {
+  while (1) {
+    uint32_t idx = atomic_fetch_add(&job->next, 1);
+    if (idx >= job->count) return;
+    job->fn(job->arg, idx);
+  }
+}
+
+#ifdef _WIN32
+DWORD WINAPI sn_parallel_worker(LPVOID arg) {
+  sn_parallel_run(arg);
+  return 0;
+}
+#else
+void* sn_parallel_worker(void* arg) {
+  sn_parallel_run(arg);
+  return NULL;
+}
+#endif
+
+uint32_t sn_cpu_count(void) {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+#else
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (uint32_t)count : 1;
+#endif
+}
+
+void sn_parallel_for(uint32_t threads, uint32_t count, sn_task_fn fn, void* arg) {
+  sn_parallel_t job;
+  job.fn = fn;
+  job.arg = arg;
+  job.count = count;
+  atomic_init(&job.next, 0);
+
+  uint32_t workers = (threads < count ? threads : count);
+  workers = workers > 0 ? workers - 1 : 0;
+
+  sn_thread_t* handles = NULL;
+  if (workers > 0) {
+    handles = malloc(workers * sizeof(sn_thread_t));
+  }
+
+  // no memory for handles is fine, we will just do all the work here
+  uint32_t spawned = 0;
+  while (handles != NULL && spawned < workers) {
+#ifdef _WIN32
+    handles[spawned] = CreateThread(NULL, 0, sn_parallel_worker, &job, 0, NULL);
+    if (handles[spawned] == NULL) break;
+#else
+    if (pthread_create(&handles[spawned], NULL, sn_parallel_worker, &job) != 0) break;
+#endif
+    spawned++;
+  }
+
+  sn_parallel_run(&job);
+
+  for (uint32_t i = 0; i < spawned; i++) {
+#ifdef _WIN32
+    WaitForSingleObject(handles[i], INFINITE);
+    CloseHandle(handles[i]);
+#else
+    pthread_join(handles[i], NULL);
+#endif
+  }
+
+  free(handles);
+}
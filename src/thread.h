@@ -0,0 +1,15 @@
+#ifndef sn_thread_H
+#define sn_thread_H
+
+#include <stdint.h>
+
+typedef void (*sn_task_fn)(void* arg, uint32_t idx);
+
+// number of online cpus, never 0
+uint32_t sn_cpu_count(void);
+
+// calls fn(arg, i) for every i in [0, count) on up to `threads` workers (the caller is one of them)
+// and returns when all are done, if a worker can't be spawned the rest just pick up its share
+void sn_parallel_for(uint32_t threads, uint32_t count, sn_task_fn fn, void* arg);
+
+#endif